@@ -0,0 +1,292 @@
+#ifndef NNBAR_LARCVMAKER_COMPACTIMAGE_H
+#define NNBAR_LARCVMAKER_COMPACTIMAGE_H
+
+// Quantised storage for larcv images.
+//
+// kInt16 stores round((pixel - offset)/scale) with a fixed scale and offset
+// chosen by the job; with scale 1 and offset 0 the 12-bit ADCs are exact.
+// kInt8 picks a per-image scale and offset spanning the image's min..max.
+// Pixels are expanded back to float on read.
+
+// local includes
+#include "DataFormat/Image2D.h"
+#include "nnbar/LArCVMaker/SidecarFileName.h"
+
+// root includes
+#include "TFile.h"
+#include "TTree.h"
+
+// c++ includes
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+namespace nnbar {
+
+enum PixelEncoding_t { kPixelFloat = 0, kPixelInt16 = 1, kPixelInt8 = 2 };
+
+inline PixelEncoding_t PixelEncodingFromString(std::string const & name) {
+  if (name == "float") return kPixelFloat;
+  if (name == "int16") return kPixelInt16;
+  if (name == "int8") return kPixelInt8;
+  throw std::invalid_argument("Unknown pixel encoding \"" + name + "\", expected float, int16 or int8");
+} // function PixelEncodingFromString
+
+/// Name of the compact image file belonging to a larcv output file
+inline std::string CompactImageFileName(std::string const & larcv_filename) {
+  return SidecarFileName(larcv_filename,"_compact");
+} // function CompactImageFileName
+
+/// One quantised image, flattened as one row of the compact_image tree
+struct CompactImage {
+
+  ULong64_t entry;     ///< entry number in the larcv output file
+  UInt_t run;
+  UInt_t subrun;
+  UInt_t event;
+  UShort_t index;      ///< position of the image within its entry
+  Int_t encoding;
+  Float_t scale;
+  Float_t offset;
+  UInt_t rows;
+  UInt_t cols;
+  Double_t width;
+  Double_t height;
+  Double_t origin_x;
+  Double_t origin_y;
+  Int_t plane;
+  std::vector<Short_t> pix16;
+  std::vector<Char_t> pix8;
+
+}; // struct CompactImage
+
+inline void Encode(larcv::Image2D const & image, PixelEncoding_t encoding,
+    float scale, float offset, CompactImage & out) {
+
+  larcv::ImageMeta const & meta = image.meta();
+  out.rows = meta.rows();
+  out.cols = meta.cols();
+  out.width = meta.width();
+  out.height = meta.height();
+  out.origin_x = meta.min_x();
+  out.origin_y = meta.max_y();
+  out.plane = meta.plane();
+  out.encoding = encoding;
+  out.pix16.clear();
+  out.pix8.clear();
+
+  std::vector<float> const & pixels = image.as_vector();
+  if (encoding == kPixelInt16) {
+    out.scale = scale;
+    out.offset = offset;
+    out.pix16.resize(pixels.size());
+    const float lo = std::numeric_limits<Short_t>::min();
+    const float hi = std::numeric_limits<Short_t>::max();
+    for (size_t it = 0; it < pixels.size(); ++it)
+      out.pix16[it] = (Short_t)std::round(std::min(hi,std::max(lo,(pixels[it] - offset)/scale)));
+  }
+  else if (encoding == kPixelInt8) {
+    float min = pixels.empty() ? 0 : *std::min_element(pixels.begin(),pixels.end());
+    float max = pixels.empty() ? 0 : *std::max_element(pixels.begin(),pixels.end());
+    out.offset = min;
+    out.scale = max > min ? (max - min)/255 : 1;
+    out.pix8.resize(pixels.size());
+    for (size_t it = 0; it < pixels.size(); ++it)
+      out.pix8[it] = (Char_t)((int)std::round((pixels[it] - out.offset)/out.scale) - 128);
+  }
+  else
+    throw std::invalid_argument("Encode: float images are not quantised");
+} // function Encode
+
+inline larcv::Image2D Decode(CompactImage const & in) {
+
+  std::vector<float> pixels;
+  if (in.encoding == kPixelInt16) {
+    pixels.resize(in.pix16.size());
+    for (size_t it = 0; it < in.pix16.size(); ++it)
+      pixels[it] = in.pix16[it]*in.scale + in.offset;
+  }
+  else if (in.encoding == kPixelInt8) {
+    pixels.resize(in.pix8.size());
+    for (size_t it = 0; it < in.pix8.size(); ++it)
+      pixels[it] = ((int)(signed char)in.pix8[it] + 128)*in.scale + in.offset;
+  }
+  else
+    throw std::runtime_error("Decode: unknown pixel encoding");
+
+  larcv::ImageMeta meta(in.width,in.height,in.rows,in.cols,in.origin_x,in.origin_y,(larcv::PlaneID_t)in.plane);
+  return larcv::Image2D(meta,pixels);
+} // function Decode
+
+/// Connects the compact_image TTree branches to a single record
+inline void CompactImageBranches(TTree* tree, CompactImage & img,
+    std::vector<Short_t>* & pix16, std::vector<Char_t>* & pix8, bool write) {
+  if (write) {
+    tree->Branch("entry",&img.entry,"entry/l");
+    tree->Branch("run",&img.run,"run/i");
+    tree->Branch("subrun",&img.subrun,"subrun/i");
+    tree->Branch("event",&img.event,"event/i");
+    tree->Branch("index",&img.index,"index/s");
+    tree->Branch("encoding",&img.encoding,"encoding/I");
+    tree->Branch("scale",&img.scale,"scale/F");
+    tree->Branch("offset",&img.offset,"offset/F");
+    tree->Branch("rows",&img.rows,"rows/i");
+    tree->Branch("cols",&img.cols,"cols/i");
+    tree->Branch("width",&img.width,"width/D");
+    tree->Branch("height",&img.height,"height/D");
+    tree->Branch("origin_x",&img.origin_x,"origin_x/D");
+    tree->Branch("origin_y",&img.origin_y,"origin_y/D");
+    tree->Branch("plane",&img.plane,"plane/I");
+    tree->Branch("pix16",&pix16);
+    tree->Branch("pix8",&pix8);
+  }
+  else {
+    tree->SetBranchAddress("entry",&img.entry);
+    tree->SetBranchAddress("run",&img.run);
+    tree->SetBranchAddress("subrun",&img.subrun);
+    tree->SetBranchAddress("event",&img.event);
+    tree->SetBranchAddress("index",&img.index);
+    tree->SetBranchAddress("encoding",&img.encoding);
+    tree->SetBranchAddress("scale",&img.scale);
+    tree->SetBranchAddress("offset",&img.offset);
+    tree->SetBranchAddress("rows",&img.rows);
+    tree->SetBranchAddress("cols",&img.cols);
+    tree->SetBranchAddress("width",&img.width);
+    tree->SetBranchAddress("height",&img.height);
+    tree->SetBranchAddress("origin_x",&img.origin_x);
+    tree->SetBranchAddress("origin_y",&img.origin_y);
+    tree->SetBranchAddress("plane",&img.plane);
+    tree->SetBranchAddress("pix16",&pix16);
+    tree->SetBranchAddress("pix8",&pix8);
+  }
+} // function CompactImageBranches
+
+/// Streams quantised images to a compact_image tree, one row per image
+class CompactImageWriter {
+
+public:
+
+  CompactImageWriter() : fFile(nullptr), fTree(nullptr), fPix16(&fImage.pix16), fPix8(&fImage.pix8) {}
+  ~CompactImageWriter() { Close(); }
+
+  void Open(std::string const & filename, PixelEncoding_t encoding, float scale, float offset) {
+    fEncoding = encoding;
+    fScale = scale;
+    fOffset = offset;
+    fFile = new TFile(filename.c_str(),"RECREATE");
+    fTree = new TTree("compact_image","quantised larcv images");
+    CompactImageBranches(fTree,fImage,fPix16,fPix8,true);
+  } // function CompactImageWriter::Open
+
+  void Fill(larcv::Image2D const & image, ULong64_t entry,
+      UInt_t run, UInt_t subrun, UInt_t event, UShort_t index) {
+    Encode(image,fEncoding,fScale,fOffset,fImage);
+    fImage.entry = entry;
+    fImage.run = run;
+    fImage.subrun = subrun;
+    fImage.event = event;
+    fImage.index = index;
+    fTree->Fill();
+  } // function CompactImageWriter::Fill
+
+  /// Copies an already quantised row, e.g. when merging compact files
+  void FillRaw(CompactImage const & image) {
+    fImage = image;
+    fTree->Fill();
+  } // function CompactImageWriter::FillRaw
+
+  void Close() {
+    if (!fFile) return;
+    fFile->cd();
+    fTree->Write();
+    fFile->Close();
+    delete fFile;
+    fFile = nullptr;
+    fTree = nullptr;
+  } // function CompactImageWriter::Close
+
+private:
+
+  TFile* fFile;
+  TTree* fTree;
+  PixelEncoding_t fEncoding;
+  float fScale;
+  float fOffset;
+  CompactImage fImage;
+  std::vector<Short_t>* fPix16;
+  std::vector<Char_t>* fPix8;
+
+}; // class CompactImageWriter
+
+/// Reads a compact_image tree back as float larcv images, grouped by larcv entry
+class CompactImageReader {
+
+public:
+
+  explicit CompactImageReader(std::string const & filename)
+    : fFile(new TFile(filename.c_str(),"READ")), fPix16(&fImage.pix16), fPix8(&fImage.pix8) {
+    if (fFile->IsZombie())
+      throw std::runtime_error("CompactImageReader: cannot open " + filename);
+    fTree = (TTree*)fFile->Get("compact_image");
+    if (!fTree)
+      throw std::runtime_error("CompactImageReader: no compact_image tree in " + filename);
+    CompactImageBranches(fTree,fImage,fPix16,fPix8,false);
+
+    // only the entry branch is read to build the lookup
+    fTree->SetBranchStatus("*",false);
+    fTree->SetBranchStatus("entry",true);
+    for (Long64_t it = 0; it < fTree->GetEntries(); ++it) {
+      fTree->GetEntry(it);
+      if (fImage.entry >= fFirstRow.size()) {
+        fFirstRow.resize(fImage.entry+1,-1);
+        fNumberRows.resize(fImage.entry+1,0);
+      }
+      if (fFirstRow[fImage.entry] < 0) fFirstRow[fImage.entry] = it;
+      ++fNumberRows[fImage.entry];
+    }
+    fTree->SetBranchStatus("*",true);
+  } // function CompactImageReader::CompactImageReader
+
+  ~CompactImageReader() { fFile->Close(); }
+
+  CompactImageReader(CompactImageReader const &) = delete;
+  CompactImageReader & operator=(CompactImageReader const &) = delete;
+
+  size_t NumberImages(size_t entry) const {
+    if (entry >= fFirstRow.size() || fFirstRow[entry] < 0) return 0;
+    return fNumberRows[entry];
+  } // function CompactImageReader::NumberImages
+
+  /// Quantised row of image i of a larcv entry; valid until the next read
+  CompactImage const & RawImage(size_t entry, size_t i) {
+    fTree->GetEntry(fFirstRow[entry] + i);
+    return fImage;
+  } // function CompactImageReader::RawImage
+
+  /// Images written for one larcv entry, in their original order
+  std::vector<larcv::Image2D> Images(size_t entry) {
+    std::vector<larcv::Image2D> images;
+    for (size_t it = 0; it < NumberImages(entry); ++it)
+      images.push_back(Decode(RawImage(entry,it)));
+    return images;
+  } // function CompactImageReader::Images
+
+private:
+
+  std::unique_ptr<TFile> fFile;
+  TTree* fTree;
+  CompactImage fImage;
+  std::vector<Short_t>* fPix16;
+  std::vector<Char_t>* fPix8;
+  std::vector<Long64_t> fFirstRow;
+  std::vector<Long64_t> fNumberRows;
+
+}; // class CompactImageReader
+
+} // namespace nnbar
+
+#endif // NNBAR_LARCVMAKER_COMPACTIMAGE_H
@@ -0,0 +1,169 @@
+#ifndef NNBAR_LARCVMAKER_LARCVINDEX_H
+#define NNBAR_LARCVMAKER_LARCVINDEX_H
+
+// local includes
+#include "nnbar/LArCVMaker/SidecarFileName.h"
+
+// root includes
+#include "TFile.h"
+#include "TTree.h"
+
+// c++ includes
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <tuple>
+
+namespace nnbar {
+
+/// One record of the sidecar index written next to each larcv output file
+struct LArCVIndexEntry {
+
+  ULong64_t entry;         ///< entry number in the larcv output file
+  UInt_t run;
+  UInt_t subrun;
+  UInt_t event;
+  Int_t apa;
+  Int_t tpc;
+  Int_t event_type;
+  Int_t first_tick;        ///< first readout tick of the image window
+  Double_t pixel_sum;      ///< pedestal-subtracted charge of pixels above ADCCut
+  UInt_t active_pixels;    ///< number of pixels more than ADCCut above pedestal
+
+}; // struct LArCVIndexEntry
+
+inline bool operator<(LArCVIndexEntry const & a, LArCVIndexEntry const & b) {
+  return std::tie(a.run,a.subrun,a.event,a.entry) < std::tie(b.run,b.subrun,b.event,b.entry);
+}
+
+/// Name of the index file belonging to a larcv output file
+inline std::string LArCVIndexFileName(std::string const & larcv_filename) {
+  return SidecarFileName(larcv_filename,"_index");
+} // function LArCVIndexFileName
+
+/// Connects the index TTree branches to a single record
+inline void LArCVIndexBranches(TTree* tree, LArCVIndexEntry & e, bool write) {
+  if (write) {
+    tree->Branch("entry",&e.entry,"entry/l");
+    tree->Branch("run",&e.run,"run/i");
+    tree->Branch("subrun",&e.subrun,"subrun/i");
+    tree->Branch("event",&e.event,"event/i");
+    tree->Branch("apa",&e.apa,"apa/I");
+    tree->Branch("tpc",&e.tpc,"tpc/I");
+    tree->Branch("event_type",&e.event_type,"event_type/I");
+    tree->Branch("first_tick",&e.first_tick,"first_tick/I");
+    tree->Branch("pixel_sum",&e.pixel_sum,"pixel_sum/D");
+    tree->Branch("active_pixels",&e.active_pixels,"active_pixels/i");
+  }
+  else {
+    tree->SetBranchAddress("entry",&e.entry);
+    tree->SetBranchAddress("run",&e.run);
+    tree->SetBranchAddress("subrun",&e.subrun);
+    tree->SetBranchAddress("event",&e.event);
+    tree->SetBranchAddress("apa",&e.apa);
+    tree->SetBranchAddress("tpc",&e.tpc);
+    tree->SetBranchAddress("event_type",&e.event_type);
+    if (tree->GetBranch("first_tick")) tree->SetBranchAddress("first_tick",&e.first_tick);
+    tree->SetBranchAddress("pixel_sum",&e.pixel_sum);
+    tree->SetBranchAddress("active_pixels",&e.active_pixels);
+  }
+} // function LArCVIndexBranches
+
+/// Collects index records during the job and writes them sorted by run/subrun/event
+class LArCVIndexWriter {
+
+public:
+
+  void Add(LArCVIndexEntry const & e) { fEntries.push_back(e); }
+  void Clear() { fEntries.clear(); }
+  size_t size() const { return fEntries.size(); }
+
+  void Write(std::string const & filename) {
+    std::sort(fEntries.begin(),fEntries.end());
+    TFile f(filename.c_str(),"RECREATE");
+    TTree* tree = new TTree("index","larcv entry index");
+    LArCVIndexEntry e;
+    LArCVIndexBranches(tree,e,true);
+    for (LArCVIndexEntry const & it : fEntries) {
+      e = it;
+      tree->Fill();
+    }
+    tree->Write();
+    f.Close();
+  } // function LArCVIndexWriter::Write
+
+private:
+
+  std::vector<LArCVIndexEntry> fEntries;
+
+}; // class LArCVIndexWriter
+
+/// Loads an index file and selects larcv entries without touching any image.
+/// Selected entry numbers come back in ascending order, so they can be fed
+/// straight to larcv::IOManager::read_entry for sequential seeks.
+class LArCVIndexReader {
+
+public:
+
+  explicit LArCVIndexReader(std::string const & filename) {
+    TFile f(filename.c_str(),"READ");
+    if (f.IsZombie())
+      throw std::runtime_error("LArCVIndexReader: cannot open " + filename);
+    TTree* tree = (TTree*)f.Get("index");
+    if (!tree)
+      throw std::runtime_error("LArCVIndexReader: no index tree in " + filename);
+    LArCVIndexEntry e;
+    e.first_tick = 0;
+    LArCVIndexBranches(tree,e,false);
+    fEntries.reserve(tree->GetEntries());
+    for (Long64_t it = 0; it < tree->GetEntries(); ++it) {
+      tree->GetEntry(it);
+      fEntries.push_back(e);
+    }
+    // files written by older jobs or merged by hand may not be sorted
+    if (!std::is_sorted(fEntries.begin(),fEntries.end()))
+      std::sort(fEntries.begin(),fEntries.end());
+  } // function LArCVIndexReader::LArCVIndexReader
+
+  size_t size() const { return fEntries.size(); }
+  std::vector<LArCVIndexEntry> const & Entries() const { return fEntries; }
+
+  /// Returns the record for run/subrun/event, or nullptr if not present
+  LArCVIndexEntry const * Find(UInt_t run, UInt_t subrun, UInt_t event) const {
+    LArCVIndexEntry key;
+    key.run = run;
+    key.subrun = subrun;
+    key.event = event;
+    key.entry = 0;
+    auto it = std::lower_bound(fEntries.begin(),fEntries.end(),key);
+    if (it == fEntries.end() || it->run != run || it->subrun != subrun || it->event != event)
+      return nullptr;
+    return &(*it);
+  } // function LArCVIndexReader::Find
+
+  std::vector<LArCVIndexEntry> Select(std::function<bool(LArCVIndexEntry const &)> pass) const {
+    std::vector<LArCVIndexEntry> selected;
+    for (LArCVIndexEntry const & e : fEntries)
+      if (pass(e)) selected.push_back(e);
+    return selected;
+  } // function LArCVIndexReader::Select
+
+  std::vector<size_t> SelectEntries(std::function<bool(LArCVIndexEntry const &)> pass) const {
+    std::vector<size_t> selected;
+    for (LArCVIndexEntry const & e : fEntries)
+      if (pass(e)) selected.push_back(e.entry);
+    std::sort(selected.begin(),selected.end());
+    return selected;
+  } // function LArCVIndexReader::SelectEntries
+
+private:
+
+  std::vector<LArCVIndexEntry> fEntries;
+
+}; // class LArCVIndexReader
+
+} // namespace nnbar
+
+#endif // NNBAR_LARCVMAKER_LARCVINDEX_H
@@ -2,10 +2,13 @@
 #include "art/Framework/Core/ModuleMacros.h"
 #include "art/Framework/Core/EDAnalyzer.h"
 #include "art/Framework/Services/Optional/TFileService.h"
+#include "art/Framework/Services/Optional/RandomNumberGenerator.h"
 #include "fhiclcpp/ParameterSet.h"
 
 // data product includes
 #include "larcore/Geometry/Geometry.h"
+#include "lardata/DetectorInfoServices/DetectorClocksService.h"
+#include "lardata/DetectorInfoServices/DetectorPropertiesService.h"
 #include "lardataobj/RecoBase/Wire.h"
 #include "lardataobj/RawData/RawDigit.h"
 #include "lardataobj/RawData/raw.h"
@@ -13,6 +16,10 @@
 #include "nusimdata/SimulationBase/MCTruth.h"
 #include "lardataobj/Simulation/SupernovaTruth.h"
 
+// random number includes
+#include "CLHEP/Random/RandFlat.h"
+#include "CLHEP/Random/RandPoisson.h"
+
 // root includes
 #include "TFile.h"
 #include "TTree.h"
@@ -27,17 +34,32 @@
 #include <algorithm>
 #include <cmath>
 #include <map>
+#include <stdexcept>
+#include <cstdlib>
 
 // local includes
 #include "DataFormat/EventImage2D.h"
 #include "DataFormat/EventROI.h"
 #include "DataFormat/IOManager.h"
+#include "nnbar/LArCVMaker/LArCVIndex.h"
+#include "nnbar/LArCVMaker/WaveformCache.h"
+#include "nnbar/LArCVMaker/CompactImage.h"
 
 #include <iostream>
 #include <fstream>
 
 namespace nnbar {
 
+/// Pre-decoded background APA waveforms overlaid on signal events
+struct BackgroundLibrary {
+
+  std::string name;
+  std::string file;
+  double rate; ///< mean number of library events added per signal event
+  std::unique_ptr<WaveformCacheReader> cache;
+
+}; // struct BackgroundLibrary
+
 class LArCVMaker : public art::EDAnalyzer {
   
 public:
@@ -56,6 +78,23 @@ private:
   int FindAPAWithNeutrino(std::vector<int> apas, art::Event const & evt);
   int FindTPCWithNeutrino(std::vector<int> apas, art::Event const & evt);
   int FindROI(int apa, int plane);
+  int FindMostActiveAPA();
+  void CacheWaveforms(art::Handle<std::vector<raw::RawDigit>> const & wireh,
+      art::Event const & evt, int best_tpc);
+  void OverlayBackground(int apa);
+  void WriteImages(std::vector<larcv::Image2D> & image_v, art::Event const & evt);
+  void TileImage(larcv::Image2D && image, std::vector<float> const & pedestal,
+      int first_wire, int first_tick, int plane,
+      std::vector<larcv::Image2D> & image_v, std::vector<larcv::ImageMeta> & tile_meta);
+  void AppendTileROIs(larcv::EventROI* roi_v, int event_type,
+      std::vector<larcv::ImageMeta> const & tile_meta);
+  void RecordIndex(art::Event const & evt, int tpc, int event_type, int first_tick,
+      double pixel_sum, unsigned int active_pixels);
+  void StreamWindows(art::Handle<std::vector<raw::RawDigit>> const & wireh, art::Event const & evt);
+  void EmitWindow(art::Event const & evt, int tpc, int first_wire,
+      std::vector<raw::RawDigit::ADCvector_t const *> const & source,
+      std::vector<float> const & pedestal, size_t first_tick,
+      std::vector<art::Ptr<simb::MCTruth>> const & nu_truth, std::vector<int> const & nu_tick);
 
   larcv::IOManager fMgr;
 
@@ -63,6 +102,23 @@ private:
   int fMaxTick;
   int fADCCut;
   int fEventType;
+  bool fWriteIndex;
+  bool fWriteWaveformCache;
+  bool fLibraryMode;
+  int fLibraryAPA;
+  PixelEncoding_t fPixelEncoding;
+  float fPixelScale;
+  float fPixelOffset;
+  bool fStreamingMode;
+  int fStreamTPC;
+  int fWindowTicks;
+  int fWindowStride;
+  int fTileRows;
+  int fTileCols;
+  int fTileRowStride;
+  int fTileColStride;
+  int fTileTopK;
+  double fTileThreshold;
 
   int fFirstWire;
   int fLastWire;
@@ -77,8 +133,17 @@ private:
   int fAPA;
   int fNumberWires;
   int fNumberTicks;
+  TVector3 fVertex;
+
+  size_t fEntry;
+  std::string fIndexFileName;
+  LArCVIndexWriter fIndex;
+  WaveformCacheWriter fCache;
+  CompactImageWriter fCompact;
+  std::vector<BackgroundLibrary> fBackgrounds;
 
   std::map<int,std::vector<float>> fWireMap;
+  std::map<int,float> fPedestalMap;
   //std::ofstream pdg;
   TH1D* hADCSpectrum;
   TFile* SpectrumFile;
@@ -91,8 +156,61 @@ LArCVMaker::LArCVMaker(fhicl::ParameterSet const & pset) :
     fWireModuleLabel(pset.get<std::string>("WireModuleLabel")),
     fMaxTick(pset.get<int>("MaxTick")),
     fADCCut(pset.get<int>("ADCCut")),
-    fEventType(pset.get<int>("EventType"))
-{} // function LArCVMaker::LArCVMaker
+    fEventType(pset.get<int>("EventType")),
+    fWriteIndex(pset.get<bool>("WriteIndex")),
+    fWriteWaveformCache(pset.get<bool>("WriteWaveformCache")),
+    fLibraryMode(pset.get<bool>("LibraryMode")),
+    fLibraryAPA(pset.get<int>("LibraryAPA")),
+    fPixelEncoding(PixelEncodingFromString(pset.get<std::string>("PixelEncoding"))),
+    fPixelScale(pset.get<float>("PixelScale")),
+    fPixelOffset(pset.get<float>("PixelOffset")),
+    fStreamingMode(pset.get<bool>("StreamingMode")),
+    fStreamTPC(pset.get<int>("StreamTPC")),
+    fWindowTicks(pset.get<int>("WindowTicks")),
+    fWindowStride(pset.get<int>("WindowStride")),
+    fTileRows(pset.get<int>("TileRows")),
+    fTileCols(pset.get<int>("TileCols")),
+    fTileRowStride(pset.get<int>("TileRowStride")),
+    fTileColStride(pset.get<int>("TileColStride")),
+    fTileTopK(pset.get<int>("TileTopK")),
+    fTileThreshold(pset.get<double>("TileThreshold")),
+    fEntry(0)
+{
+
+  for (fhicl::ParameterSet const & lib : pset.get<std::vector<fhicl::ParameterSet>>("BackgroundLibraries")) {
+    BackgroundLibrary background;
+    background.name = lib.get<std::string>("Name");
+    background.file = lib.get<std::string>("File");
+    background.rate = lib.get<double>("Rate");
+    fBackgrounds.push_back(std::move(background));
+  }
+  if (!fBackgrounds.empty()) {
+    // grid jobs share one fcl, so offset the seed by the job number to keep their overlays independent
+    unsigned int seed = pset.get<unsigned int>("Seed");
+    if (std::getenv("PROCESS") != nullptr) seed += std::strtoul(std::getenv("PROCESS"),nullptr,10);
+    else std::cout << "PROCESS is not set; background overlay uses the fixed Seed " << seed << std::endl;
+    createEngine(seed);
+  }
+
+  if (fLibraryMode) {
+    if (fStreamingMode || !fBackgrounds.empty())
+      throw std::runtime_error("LArCVMaker: LibraryMode writes background-only caches and cannot stream or overlay");
+    fWriteWaveformCache = true;
+  }
+
+  if (fPixelScale <= 0)
+    throw std::runtime_error("LArCVMaker: PixelScale must be positive");
+
+  if (fTileRows > 0 && (fTileCols <= 0 || fTileRowStride <= 0 || fTileColStride <= 0))
+    throw std::runtime_error("LArCVMaker: TileCols, TileRowStride and TileColStride must be positive when tiling");
+
+  if (fStreamingMode) {
+    if (fWindowTicks <= 0 || fWindowStride <= 0)
+      throw std::runtime_error("LArCVMaker: WindowTicks and WindowStride must be positive");
+    if (fWriteWaveformCache || !fBackgrounds.empty())
+      throw std::runtime_error("LArCVMaker: waveform cache and background overlay need the full readout, not StreamingMode");
+  }
+} // function LArCVMaker::LArCVMaker
 
 void LArCVMaker::beginJob() {
   std::ofstream pdg;
@@ -101,7 +219,21 @@ void LArCVMaker::beginJob() {
   if (std::getenv("PROCESS") != nullptr) filename = "larcv_" + std::string(std::getenv("PROCESS")) + ".root";
   else filename = "larcv.root";
   fMgr.set_out_file(filename);
+  fIndexFileName = LArCVIndexFileName(filename);
   fMgr.initialize();
+  if (fPixelEncoding != kPixelFloat)
+    fCompact.Open(CompactImageFileName(filename),fPixelEncoding,fPixelScale,fPixelOffset);
+  if (fWriteWaveformCache) {
+    if (std::getenv("PROCESS") != nullptr) fCache.Open("waveforms_" + std::string(std::getenv("PROCESS")) + ".wfc");
+    else fCache.Open("waveforms.wfc");
+  }
+  for (BackgroundLibrary & background : fBackgrounds) {
+    background.cache.reset(new WaveformCacheReader(background.file));
+    std::cout << "Loaded " << background.cache->size() << " " << background.name
+              << " background events from " << background.file << std::endl;
+    if (background.cache->size() == 0)
+      throw std::runtime_error("LArCVMaker: background library " + background.file + " is empty");
+  }
   SpectrumFile = new TFile("./SignalADCSpectrum.root","RECREATE");
   hADCSpectrum = new TH1D("hADCSpectrum","ADC Spectrum Collection; ADC; Entries",4096, 0., 4096.);
 } // function LArCVMaker::beginJob
@@ -112,13 +244,18 @@ void LArCVMaker::endJob() {
   hADCSpectrum->Write();
   SpectrumFile->Close();
   fMgr.finalize();
+  if (fPixelEncoding != kPixelFloat) fCompact.Close();
+  if (fWriteIndex) fIndex.Write(fIndexFileName);
+  if (fWriteWaveformCache) fCache.Close();
 } // function LArCVMaker::endJob
 
 void LArCVMaker::ClearData() {
 
   ResetROI();
   fAPA = -1;
+  fVertex = TVector3(0,0,0);
   fWireMap.clear();
+  fPedestalMap.clear();
 } // function LArCVMaker::ClearData
 
 void LArCVMaker::ResetROI() {
@@ -194,6 +331,10 @@ int LArCVMaker::FindTPCWithNeutrino(std::vector<int> tpcs, art::Event const & ev
   if (evt.getByLabel("marley",TruthListHandle))
   
   art::fill_ptr_vector(TruthList,TruthListHandle);
+  if (TruthList.empty()) {
+    std::cout << "No MARLEY truth in this event!" << std::endl;
+    return -1;
+  }
   art::Ptr<simb::MCTruth> mct = TruthList.at(0);
 
   for ( auto i = 0; i < mct->NParticles(); i++ ) {
@@ -211,6 +352,7 @@ int LArCVMaker::FindTPCWithNeutrino(std::vector<int> tpcs, art::Event const & ev
 
     if (tpc.ContainsPosition(vertex_position)) {
       fVertexTPC = it_tpc;
+      fVertex = vertex_position;
 
       //std::cout << "which tpc contains vertex? "<<it_tpc << std::endl;
       //std::cout << "which TPC is assigned? " << fVertexTPC << std::endl;
@@ -226,6 +368,25 @@ int LArCVMaker::FindTPCWithNeutrino(std::vector<int> tpcs, art::Event const & ev
 
 } // function LArCVMaker::FindBestAPA
 
+int LArCVMaker::FindMostActiveAPA() {
+
+  // charge more than ADCCut above pedestal, summed over each APA
+  std::map<int,double> charge;
+  for (auto const & it : fWireMap) {
+    float pedestal = fPedestalMap[it.first];
+    for (float adc : it.second)
+      if (adc - pedestal > fADCCut) charge[it.first/2560] += adc - pedestal;
+  }
+  int best_apa = -1;
+  double best_charge = 0;
+  for (auto const & it : charge) {
+    if (it.second <= best_charge) continue;
+    best_apa = it.first;
+    best_charge = it.second;
+  }
+  return best_apa;
+} // function LArCVMaker::FindMostActiveAPA
+
 int LArCVMaker::FindROI(int best_apa, int plane) {
   
   ResetROI();
@@ -258,6 +419,298 @@ int LArCVMaker::FindROI(int best_apa, int plane) {
   return downsample;
 } // function LArCVMaker::FindROI
 
+void LArCVMaker::CacheWaveforms(art::Handle<std::vector<raw::RawDigit>> const & wireh,
+    art::Event const & evt, int best_tpc) {
+
+  // store the whole APA, so any plane, TPC side or tick window can be re-imaged
+  WaveformEventHeader header;
+  header.run = evt.id().run();
+  header.subrun = evt.id().subRun();
+  header.event = evt.id().event();
+  header.apa = fAPA;
+  header.tpc = best_tpc;
+  header.vertex[0] = fVertex.X();
+  header.vertex[1] = fVertex.Y();
+  header.vertex[2] = fVertex.Z();
+  header.first_channel = 2560*fAPA;
+  header.nchannels = 2560;
+  header.nticks = 0;
+  header.event_type = fEventType;
+
+  for (int it_channel = 0; it_channel < (int)header.nchannels; ++it_channel) {
+    auto it = fWireMap.find(it_channel + header.first_channel);
+    if (it != fWireMap.end() && it->second.size() > header.nticks)
+      header.nticks = it->second.size();
+  }
+
+  std::vector<float> pedestal(header.nchannels,0);
+  std::vector<int16_t> adc((size_t)header.nchannels*header.nticks,0);
+  for (std::vector<raw::RawDigit>::const_iterator it = wireh->begin();
+      it != wireh->end(); ++it) {
+    int channel = it->Channel() - header.first_channel;
+    if (channel < 0 || channel >= (int)header.nchannels) continue;
+    pedestal[channel] = it->GetPedestal();
+    std::vector<float> const & waveform = fWireMap[it->Channel()];
+    std::copy(waveform.begin(),waveform.end(),adc.begin() + (size_t)channel*header.nticks);
+  }
+  fCache.Add(header,pedestal,adc);
+} // function LArCVMaker::CacheWaveforms
+
+void LArCVMaker::OverlayBackground(int apa) {
+
+  art::ServiceHandle<art::RandomNumberGenerator> rng;
+  CLHEP::HepRandomEngine & engine = rng->getEngine();
+  CLHEP::RandPoisson poisson(engine);
+  CLHEP::RandFlat flat(engine);
+
+  for (BackgroundLibrary const & background : fBackgrounds) {
+    long n_overlay = poisson.fire(background.rate);
+    for (long it_overlay = 0; it_overlay < n_overlay; ++it_overlay) {
+      WaveformEvent e = background.cache->Event(flat.fireInt(background.cache->size()));
+      // library events may come from any APA; they are added channel by channel.
+      // Only their pedestal is removed, so they must be made without electronics noise
+      for (size_t it_channel = 0; it_channel < e.header->nchannels && it_channel < 2560; ++it_channel) {
+        auto it = fWireMap.find(2560*apa + it_channel);
+        if (it == fWireMap.end()) continue;
+        float* signal = it->second.data();
+        int16_t const * bkg = e.Waveform(it_channel);
+        float pedestal = e.pedestal[it_channel];
+        size_t nticks = std::min<size_t>(it->second.size(),e.header->nticks);
+        for (size_t it_tick = 0; it_tick < nticks; ++it_tick)
+          signal[it_tick] += bkg[it_tick] - pedestal;
+      }
+    }
+    std::cout << "Overlaid " << n_overlay << " " << background.name << " events" << std::endl;
+  }
+} // function LArCVMaker::OverlayBackground
+
+void LArCVMaker::WriteImages(std::vector<larcv::Image2D> & image_v, art::Event const & evt) {
+
+  // quantised images go to the compact file instead of the float image product
+  if (fPixelEncoding != kPixelFloat) {
+    for (size_t it = 0; it < image_v.size(); ++it)
+      fCompact.Fill(image_v[it],fEntry,evt.id().run(),evt.id().subRun(),evt.id().event(),it);
+    return;
+  }
+  auto images = (larcv::EventImage2D*)(fMgr.get_data(larcv::kProductImage2D, "tpc"));
+  for (larcv::Image2D & image : image_v)
+    images->Emplace(std::move(image));
+} // function LArCVMaker::WriteImages
+
+void LArCVMaker::TileImage(larcv::Image2D && image, std::vector<float> const & pedestal,
+    int first_wire, int first_tick, int plane,
+    std::vector<larcv::Image2D> & image_v, std::vector<larcv::ImageMeta> & tile_meta) {
+
+  if (fTileRows <= 0) {
+    image_v.push_back(std::move(image));
+    return;
+  }
+
+  // summed-area table of charge more than ADCCut above the row's pedestal,
+  // so every tile scores in O(1)
+  const int rows = image.meta().rows();
+  const int cols = image.meta().cols();
+  std::vector<double> charge((size_t)(rows+1)*(cols+1),0);
+  for (int it_row = 0; it_row < rows; ++it_row) {
+    double row_sum = 0;
+    for (int it_col = 0; it_col < cols; ++it_col) {
+      float value = image.pixel(it_row,it_col) - pedestal[it_row];
+      if (value > fADCCut) row_sum += value;
+      charge[(size_t)(it_row+1)*(cols+1) + it_col+1] = charge[(size_t)it_row*(cols+1) + it_col+1] + row_sum;
+    }
+  }
+
+  // tiles start every stride until one reaches the edge; the last may be zero-padded
+  std::vector<std::pair<double,std::pair<int,int>>> tiles;
+  for (int row0 = 0; ; row0 += fTileRowStride) {
+    for (int col0 = 0; ; col0 += fTileColStride) {
+      int row1 = std::min(rows,row0 + fTileRows);
+      int col1 = std::min(cols,col0 + fTileCols);
+      double score = charge[(size_t)row1*(cols+1) + col1] - charge[(size_t)row0*(cols+1) + col1]
+                   - charge[(size_t)row1*(cols+1) + col0] + charge[(size_t)row0*(cols+1) + col0];
+      tiles.push_back(std::make_pair(score,std::make_pair(row0,col0)));
+      if (col0 + fTileCols >= cols) break;
+    }
+    if (row0 + fTileRows >= rows) break;
+  }
+  std::stable_sort(tiles.begin(),tiles.end(),
+      [](std::pair<double,std::pair<int,int>> const & a, std::pair<double,std::pair<int,int>> const & b)
+      { return a.first > b.first; });
+
+  // the best tile is always kept, so every entry has at least one image
+  size_t n_tiles = 1;
+  while (n_tiles < tiles.size() && tiles[n_tiles].first > fTileThreshold
+      && (fTileTopK <= 0 || (int)n_tiles < fTileTopK))
+    ++n_tiles;
+
+  for (size_t it = 0; it < n_tiles; ++it) {
+    int row0 = tiles[it].second.first;
+    int col0 = tiles[it].second.second;
+    larcv::ImageMeta meta(fTileCols,fTileRows,fTileRows,fTileCols,
+        first_tick + col0,first_wire + row0 + fTileRows,plane);
+    larcv::Image2D tile(meta);
+    for (int it_row = 0; it_row < fTileRows && row0 + it_row < rows; ++it_row)
+      for (int it_col = 0; it_col < fTileCols && col0 + it_col < cols; ++it_col)
+        tile.set_pixel(it_row,it_col,image.pixel(row0 + it_row,col0 + it_col));
+    image_v.push_back(std::move(tile));
+    tile_meta.push_back(meta);
+  }
+  std::cout << "Kept " << n_tiles << " of " << tiles.size() << " tiles" << std::endl;
+} // function LArCVMaker::TileImage
+
+void LArCVMaker::AppendTileROIs(larcv::EventROI* roi_v, int event_type,
+    std::vector<larcv::ImageMeta> const & tile_meta) {
+
+  // an ROI holds one box per plane, so each tile gets its own ROI after the
+  // event ROI; Index() is the position of the tile in the image product
+  for (size_t it = 0; it < tile_meta.size(); ++it) {
+    larcv::ROI roi((larcv::ROIType_t)event_type);
+    roi.Index(it);
+    roi.AppendBB(tile_meta[it]);
+    roi_v->Emplace(std::move(roi));
+  }
+} // function LArCVMaker::AppendTileROIs
+
+void LArCVMaker::RecordIndex(art::Event const & evt, int tpc, int event_type, int first_tick,
+    double pixel_sum, unsigned int active_pixels) {
+
+  if (!fWriteIndex) return;
+  LArCVIndexEntry index;
+  index.entry = fEntry;
+  index.run = evt.id().run();
+  index.subrun = evt.id().subRun();
+  index.event = evt.id().event();
+  index.apa = fAPA;
+  index.tpc = tpc;
+  index.event_type = event_type;
+  index.first_tick = first_tick;
+  index.pixel_sum = pixel_sum;
+  index.active_pixels = active_pixels;
+  fIndex.Add(index);
+} // function LArCVMaker::RecordIndex
+
+void LArCVMaker::StreamWindows(art::Handle<std::vector<raw::RawDigit>> const & wireh,
+    art::Event const & evt) {
+
+  int best_tpc = fStreamTPC >= 0 ? fStreamTPC : FindTPCWithNeutrino(std::vector<int>(),evt);
+  if (best_tpc < 0) {
+    std::cout << "Skipping event. Could not find good TPC!" << std::endl;
+    return;
+  }
+  fAPA = best_tpc/2;
+
+  // collection wires of the selected TPC, as in the full-readout image
+  const int number_wires = fNumberChannels[2]/2;
+  const int first_wire = 2560*fAPA + fFirstChannel[2] + (best_tpc%2 == 1 ? number_wires : 0);
+
+  // the RawDigit product already holds the whole readout, so uncompressed
+  // windows are read from it in place; compressed digits can only be decoded
+  // whole, which is done for the ROI channels only and is bounded by the
+  // size of the product art already holds
+  std::vector<raw::RawDigit::ADCvector_t const *> source(number_wires,nullptr);
+  std::vector<raw::RawDigit::ADCvector_t> decoded(number_wires);
+  std::vector<float> pedestal(number_wires,0);
+  size_t readout_ticks = 0;
+  for (std::vector<raw::RawDigit>::const_iterator it = wireh->begin();
+      it != wireh->end(); ++it) {
+    int it_channel = (int)it->Channel() - first_wire;
+    if (it_channel < 0 || it_channel >= number_wires) continue;
+    if (it->Compression() == raw::kNone) source[it_channel] = &it->ADCs();
+    else {
+      decoded[it_channel].resize(it->Samples());
+      raw::Uncompress(it->ADCs(),decoded[it_channel],it->Compression());
+      source[it_channel] = &decoded[it_channel];
+    }
+    pedestal[it_channel] = it->GetPedestal();
+    readout_ticks = std::max(readout_ticks,source[it_channel]->size());
+    for (short adc : *source[it_channel])
+      if (adc != 0) hADCSpectrum->Fill(adc);
+  }
+
+  // MARLEY neutrinos inside the TPC, labelled by the tick their charge reaches
+  // the collection plane: the interaction tick, which TPCG4Time2Tick already
+  // counts from the readout start, plus the drift from the vertex to the plane
+  std::vector<art::Ptr<simb::MCTruth>> nu_truth;
+  std::vector<int> nu_tick;
+  art::Handle<std::vector<simb::MCTruth>> TruthListHandle;
+  std::vector<art::Ptr<simb::MCTruth>> TruthList;
+  if (evt.getByLabel("marley",TruthListHandle))
+    art::fill_ptr_vector(TruthList,TruthListHandle);
+  art::ServiceHandle<geo::Geometry> geo;
+  auto const * clocks = art::ServiceHandle<detinfo::DetectorClocksService>()->provider();
+  auto const * detprop = art::ServiceHandle<detinfo::DetectorPropertiesService>()->provider();
+  const double plane_x = geo->TPC(best_tpc).PlaneLocation(2)[0];
+  const double drift_per_tick = detprop->DriftVelocity()*clocks->TPCClock().TickPeriod();
+  for (art::Ptr<simb::MCTruth> const & mct : TruthList) {
+    simb::MCParticle const & nu = mct->GetNeutrino().Nu();
+    if (!geo->TPC(best_tpc).ContainsPosition(nu.Position(0).Vect())) continue;
+    nu_truth.push_back(mct);
+    nu_tick.push_back(clocks->TPCG4Time2Tick(nu.T()) + std::abs(nu.Vx() - plane_x)/drift_per_tick);
+  }
+
+  // the last window always ends on the last readout tick, so a stride that
+  // does not divide the readout still images its tail
+  const size_t stream_ticks = std::max(readout_ticks,(size_t)fWindowTicks);
+  for (size_t first_tick = 0; first_tick + fWindowTicks < stream_ticks; first_tick += fWindowStride)
+    EmitWindow(evt,best_tpc,first_wire,source,pedestal,first_tick,nu_truth,nu_tick);
+  EmitWindow(evt,best_tpc,first_wire,source,pedestal,stream_ticks - fWindowTicks,nu_truth,nu_tick);
+} // function LArCVMaker::StreamWindows
+
+void LArCVMaker::EmitWindow(art::Event const & evt, int tpc, int first_wire,
+    std::vector<raw::RawDigit::ADCvector_t const *> const & source,
+    std::vector<float> const & pedestal, size_t first_tick,
+    std::vector<art::Ptr<simb::MCTruth>> const & nu_truth, std::vector<int> const & nu_tick) {
+
+  fMgr.set_id(evt.id().run(),evt.id().subRun(),evt.id().event());
+
+  // rows are wires, columns are ticks; the meta carries the window origin
+  const int number_wires = source.size();
+  larcv::ImageMeta meta(fWindowTicks,number_wires,number_wires,fWindowTicks,
+      first_tick,first_wire + number_wires,2);
+  larcv::Image2D image(meta);
+  double pixel_sum = 0;
+  unsigned int active_pixels = 0;
+  for (int it_channel = 0; it_channel < number_wires; ++it_channel) {
+    raw::RawDigit::ADCvector_t const * adc = source[it_channel];
+    if (!adc) continue;
+    size_t last_tick = std::min(adc->size(),first_tick + fWindowTicks);
+    for (size_t tick = first_tick; tick < last_tick; ++tick) {
+      float value = (*adc)[tick];
+      image.set_pixel(it_channel,tick - first_tick,value);
+      float charge = value - pedestal[it_channel];
+      if (charge > fADCCut) {
+        pixel_sum += charge;
+        ++active_pixels;
+      }
+    }
+  }
+  std::vector<larcv::Image2D> image_v;
+  std::vector<larcv::ImageMeta> tile_meta;
+  TileImage(std::move(image),pedestal,first_wire,first_tick,2,image_v,tile_meta);
+  WriteImages(image_v,evt);
+
+  // windows without a MARLEY interaction are written as unknown
+  int event_type = larcv::kROIUnknown;
+  auto roi_v = (larcv::EventROI*)(fMgr.get_data(larcv::kProductROI, "tpc"));
+  larcv::ROI roi(larcv::kROIUnknown);
+  for (size_t it = 0; it < nu_tick.size(); ++it) {
+    if (nu_tick[it] < (int)first_tick || nu_tick[it] >= (int)first_tick + fWindowTicks) continue;
+    simb::MCParticle const & nu = nu_truth[it]->GetNeutrino().Nu();
+    event_type = fEventType;
+    roi = larcv::ROI((larcv::ROIType_t)fEventType);
+    roi.EnergyDeposit(nu.E());
+    roi.Momentum(nu.Px(),nu.Py(),nu.Pz());
+    roi.AppendBB(meta);
+    break;
+  }
+  roi_v->Emplace(std::move(roi));
+  AppendTileROIs(roi_v,event_type,tile_meta);
+
+  RecordIndex(evt,tpc,event_type,first_tick,pixel_sum,active_pixels);
+  fMgr.save_entry();
+  ++fEntry;
+} // function LArCVMaker::EmitWindow
+
 void LArCVMaker::analyze(art::Event const & evt) {
 
   ClearData();
@@ -273,6 +726,12 @@ void LArCVMaker::analyze(art::Event const & evt) {
   art::Handle<std::vector<raw::RawDigit>> wireh;
   evt.getByLabel(fWireModuleLabel,wireh);
 
+  // long readouts are imaged window by window without filling the wire map
+  if (fStreamingMode) {
+    StreamWindows(wireh,evt);
+    return;
+  }
+
   // initialize ROI finding variables
   std::vector<int> apas;
 
@@ -286,6 +745,7 @@ void LArCVMaker::analyze(art::Event const & evt) {
     raw::Uncompress(rawr.ADCs(), adc, rawr.Compression());
 
     fWireMap.insert(std::pair<int,std::vector<float>>(rawr.Channel(),std::vector<float>(adc.begin(),adc.end())));
+    fPedestalMap[rawr.Channel()] = rawr.GetPedestal();
     int apa = std::floor(rawr.Channel()/2560);
     if (std::find(apas.begin(),apas.end(),apa) == apas.end())
       apas.push_back(apa);
@@ -297,6 +757,17 @@ void LArCVMaker::analyze(art::Event const & evt) {
     return;
   }
   //int best_apa = FindAPAWithNeutrino(apas,evt);
+
+  // background libraries have no neutrino, so only the cache of one APA is written
+  if (fLibraryMode) {
+    fAPA = fLibraryAPA >= 0 ? fLibraryAPA : FindMostActiveAPA();
+    if (fAPA < 0) {
+      std::cout << "Skipping event. No activity above ADCCut!" << std::endl;
+      return;
+    }
+    CacheWaveforms(wireh,evt,-1);
+    return;
+  }
   
   int best_tpc = FindTPCWithNeutrino(apas,evt);
   //int best_tpc = rand() % 24;//for rad.
@@ -312,6 +783,10 @@ void LArCVMaker::analyze(art::Event const & evt) {
   }
   std::cout << fAPA<<std::endl;
 
+  // the cache keeps the pure signal, so it can itself be overlaid later
+  if (fWriteWaveformCache) CacheWaveforms(wireh,evt,best_tpc);
+  if (!fBackgrounds.empty()) OverlayBackground(best_apa);
+
   // check for problems
   for (int it_plane = 0; it_plane < 3; ++it_plane) {
     if (FindROI(best_apa,it_plane) == -1) {
@@ -321,7 +796,10 @@ void LArCVMaker::analyze(art::Event const & evt) {
   }
 
   // produce image
-  auto images = (larcv::EventImage2D*)(fMgr.get_data(larcv::kProductImage2D, "tpc"));
+  std::vector<larcv::Image2D> image_v;
+  std::vector<larcv::ImageMeta> tile_meta;
+  double pixel_sum = 0;
+  unsigned int active_pixels = 0;
   std::cout << std::endl;
   for (int it_plane = 2; it_plane < 3; ++it_plane) {
     int downsample = FindROI(best_apa,it_plane);
@@ -329,15 +807,23 @@ void LArCVMaker::analyze(art::Event const & evt) {
     std::cout << "PLANE " << it_plane << " IMAGE" << std::endl;
     std::cout << "Original image resolution " << fNumberWires << "x" << fNumberTicks;
     larcv::Image2D image(fNumberWires/2,fNumberTicks);//fNumberWires -> 
+    std::vector<float> pedestal(fNumberWires/2,0);
     for (int it_channel = 0; it_channel < fNumberWires/2; ++it_channel) {
       int channel = it_channel + fFirstWire;
       if (best_tpc%2 == 1){
 	channel = it_channel + fFirstWire + 480;
       }
+      if (fPedestalMap.find(channel) != fPedestalMap.end()) pedestal[it_channel] = fPedestalMap[channel];
       for (int it_tick = 0; it_tick < fNumberTicks; ++it_tick) {
         int tick = it_tick + fFirstTick;
         if (fWireMap.find(channel) != fWireMap.end()) {
 	  image.set_pixel(it_channel,it_tick,fWireMap[channel][tick]);
+	  // activity is measured above the pedestal, which raw ADCs still carry
+	  float charge = fWireMap[channel][tick] - fPedestalMap[channel];
+	  if (charge > fADCCut) {
+	    pixel_sum += charge;
+	    ++active_pixels;
+	  }
      
 	  //  if (it_plane ==2) 
 	  if (fWireMap[channel][tick]!=0) {
@@ -352,9 +838,11 @@ void LArCVMaker::analyze(art::Event const & evt) {
     //std::cout << " => downsampling to " << fNumberWires/downsample << "x" << fNumberTicks/(4*downsample) << "." << std::endl << std::endl;
     //image.resize(600,600,0);
     //std::cout << "resized to 600 x 600" << std::endl;
-    images->Emplace(std::move(image));
-    std::cout << "emplace done" << std::endl;
+    int first_wire = fFirstWire + (best_tpc%2 == 1 ? 480 : 0);
+    TileImage(std::move(image),pedestal,first_wire,fFirstTick,it_plane,image_v,tile_meta);
   }
+  WriteImages(image_v,evt);
+  std::cout << "emplace done" << std::endl;
   
   auto roi_v = (larcv::EventROI*)(fMgr.get_data(larcv::kProductROI, "tpc"));
 
@@ -373,8 +861,12 @@ void LArCVMaker::analyze(art::Event const & evt) {
 
   std::cout << "autoroi done" << std::endl;
   roi_v->Emplace(std::move(roi));
+  AppendTileROIs(roi_v,fEventType,tile_meta);
   std::cout << "second emplace done" << std::endl;
+
+  RecordIndex(evt,best_tpc,fEventType,fFirstTick,pixel_sum,active_pixels);
   fMgr.save_entry();
+  ++fEntry;
   std::cout << "save entry done" << std::endl;
 } // function LArCVMaker::analyze
 
@@ -0,0 +1,20 @@
+#ifndef NNBAR_LARCVMAKER_SIDECARFILENAME_H
+#define NNBAR_LARCVMAKER_SIDECARFILENAME_H
+
+// c++ includes
+#include <string>
+
+namespace nnbar {
+
+/// Name of a file written next to a larcv output file, e.g. "_index" turns
+/// larcv_3.root into larcv_3_index.root
+inline std::string SidecarFileName(std::string const & larcv_filename, std::string const & suffix) {
+  std::string stem = larcv_filename;
+  if (stem.size() > 5 && stem.compare(stem.size()-5,5,".root") == 0)
+    stem.erase(stem.size()-5);
+  return stem + suffix + ".root";
+} // function SidecarFileName
+
+} // namespace nnbar
+
+#endif // NNBAR_LARCVMAKER_SIDECARFILENAME_H
@@ -0,0 +1,184 @@
+#ifndef NNBAR_LARCVMAKER_WAVEFORMCACHE_H
+#define NNBAR_LARCVMAKER_WAVEFORMCACHE_H
+
+// Flat, memory-mappable cache of decoded per-APA waveforms.
+//
+// File layout (native byte order):
+//   WaveformCacheHeader
+//   per event: WaveformEventHeader, float pedestal[nchannels],
+//              int16 adc[nchannels][nticks]
+//   uint64 offset[nevents]   (at header.table_offset)
+//
+// Channels are stored densely from first_channel; channels missing from
+// the RawDigit collection are zero-filled with a zero pedestal.
+
+// c++ includes
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+// posix includes
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nnbar {
+
+const char kWaveformCacheMagic[8] = { 'N','N','B','W','F','C','0','1' };
+const uint32_t kWaveformCacheVersion = 1;
+
+struct WaveformCacheHeader {
+
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t nevents;
+  uint64_t table_offset;
+
+}; // struct WaveformCacheHeader
+
+struct WaveformEventHeader {
+
+  uint32_t run;
+  uint32_t subrun;
+  uint32_t event;
+  int32_t apa;
+  int32_t tpc;
+  float vertex[3];
+  uint32_t first_channel;
+  uint32_t nchannels;
+  uint32_t nticks;
+  int32_t event_type;      ///< LArCVMaker EventType; zero in caches written before it was stored
+
+}; // struct WaveformEventHeader
+
+/// Read-only view of one cached event inside a mapped file
+struct WaveformEvent {
+
+  WaveformEventHeader const * header;
+  float const * pedestal;
+  int16_t const * adc;
+
+  /// Waveform of the channel at offset ch from header->first_channel
+  int16_t const * Waveform(size_t ch) const { return adc + ch*header->nticks; }
+
+}; // struct WaveformEvent
+
+/// Appends events to a cache file; the offset table is written on Close
+class WaveformCacheWriter {
+
+public:
+
+  WaveformCacheWriter() {}
+  ~WaveformCacheWriter() { Close(); }
+
+  void Open(std::string const & filename) {
+    fFile.open(filename,std::ios::binary|std::ios::trunc);
+    if (!fFile)
+      throw std::runtime_error("WaveformCacheWriter: cannot open " + filename);
+    WaveformCacheHeader header;
+    std::memset(&header,0,sizeof(header));
+    fFile.write((char const*)&header,sizeof(header));
+    fOffsets.clear();
+  } // function WaveformCacheWriter::Open
+
+  void Add(WaveformEventHeader const & header, std::vector<float> const & pedestal,
+      std::vector<int16_t> const & adc) {
+    if (pedestal.size() != header.nchannels || adc.size() != (size_t)header.nchannels*header.nticks)
+      throw std::runtime_error("WaveformCacheWriter: event size does not match its header");
+    fOffsets.push_back(fFile.tellp());
+    fFile.write((char const*)&header,sizeof(header));
+    fFile.write((char const*)pedestal.data(),pedestal.size()*sizeof(float));
+    fFile.write((char const*)adc.data(),adc.size()*sizeof(int16_t));
+  } // function WaveformCacheWriter::Add
+
+  void Close() {
+    if (!fFile.is_open()) return;
+    WaveformCacheHeader header;
+    std::memset(&header,0,sizeof(header));
+    std::memcpy(header.magic,kWaveformCacheMagic,sizeof(header.magic));
+    header.version = kWaveformCacheVersion;
+    header.nevents = fOffsets.size();
+    header.table_offset = fFile.tellp();
+    fFile.write((char const*)fOffsets.data(),fOffsets.size()*sizeof(uint64_t));
+    fFile.seekp(0);
+    fFile.write((char const*)&header,sizeof(header));
+    fFile.close();
+  } // function WaveformCacheWriter::Close
+
+private:
+
+  std::ofstream fFile;
+  std::vector<uint64_t> fOffsets;
+
+}; // class WaveformCacheWriter
+
+/// Maps a cache file read-only; events are accessed in place without copies
+class WaveformCacheReader {
+
+public:
+
+  explicit WaveformCacheReader(std::string const & filename) : fData(nullptr), fSize(0) {
+    int fd = open(filename.c_str(),O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("WaveformCacheReader: cannot open " + filename);
+    struct stat st;
+    if (fstat(fd,&st) != 0 || (size_t)st.st_size < sizeof(WaveformCacheHeader)) {
+      close(fd);
+      throw std::runtime_error("WaveformCacheReader: " + filename + " is truncated");
+    }
+    fSize = st.st_size;
+    void* data = mmap(nullptr,fSize,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (data == MAP_FAILED)
+      throw std::runtime_error("WaveformCacheReader: cannot map " + filename);
+    fData = (char const*)data;
+
+    WaveformCacheHeader const * header = (WaveformCacheHeader const*)fData;
+    if (std::memcmp(header->magic,kWaveformCacheMagic,sizeof(header->magic)) != 0
+        || header->version != kWaveformCacheVersion
+        || header->table_offset + header->nevents*sizeof(uint64_t) > fSize) {
+      munmap((void*)fData,fSize);
+      throw std::runtime_error("WaveformCacheReader: " + filename + " is not a complete waveform cache");
+    }
+    fNEvents = header->nevents;
+    fOffsets = (uint64_t const*)(fData + header->table_offset);
+  } // function WaveformCacheReader::WaveformCacheReader
+
+  ~WaveformCacheReader() { if (fData) munmap((void*)fData,fSize); }
+
+  WaveformCacheReader(WaveformCacheReader const &) = delete;
+  WaveformCacheReader & operator=(WaveformCacheReader const &) = delete;
+
+  size_t size() const { return fNEvents; }
+
+  WaveformEvent Event(size_t i) const {
+    if (i >= fNEvents)
+      throw std::out_of_range("WaveformCacheReader: event index out of range");
+    if (fOffsets[i] + sizeof(WaveformEventHeader) > fSize)
+      throw std::runtime_error("WaveformCacheReader: event header runs past the end of the file");
+    WaveformEvent e;
+    e.header = (WaveformEventHeader const*)(fData + fOffsets[i]);
+    e.pedestal = (float const*)(fData + fOffsets[i] + sizeof(WaveformEventHeader));
+    e.adc = (int16_t const*)(e.pedestal + e.header->nchannels);
+    if ((char const*)(e.adc + (size_t)e.header->nchannels*e.header->nticks) > fData + fSize)
+      throw std::runtime_error("WaveformCacheReader: event runs past the end of the file");
+    return e;
+  } // function WaveformCacheReader::Event
+
+private:
+
+  char const * fData;
+  size_t fSize;
+  size_t fNEvents;
+  uint64_t const * fOffsets;
+
+}; // class WaveformCacheReader
+
+} // namespace nnbar
+
+#endif // NNBAR_LARCVMAKER_WAVEFORMCACHE_H
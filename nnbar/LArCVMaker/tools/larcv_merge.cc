@@ -0,0 +1,419 @@
+// Merges sharded LArCVMaker outputs into one larcv file, ordered by
+// run/subrun/event, together with their sidecar index, compact image file
+// and SignalADCSpectrum histograms.
+//
+// Inputs are scanned in parallel; inputs without entries (jobs that saved
+// nothing) are skipped. When every input is internally ordered, the inputs do
+// not interleave and their compression settings match, the larcv trees are
+// fast-cloned basket by basket in one serial pass in sorted input order, as
+// hadd would. Otherwise the per-input indices are k-way merged and entries
+// are copied one by one from one open tree per input. Inputs without a
+// sidecar index are ordered by the run/subrun/event larcv stores with each
+// entry. Either way the output order depends only on the event ids and file
+// names, never on thread scheduling.
+
+// local includes
+#include "nnbar/LArCVMaker/LArCVIndex.h"
+#include "nnbar/LArCVMaker/CompactImage.h"
+#include "DataFormat/EventROI.h"
+#include "DataFormat/IOManager.h"
+
+// root includes
+#include "TFile.h"
+#include "TTree.h"
+#include "TChain.h"
+#include "TKey.h"
+#include "TH1D.h"
+#include "TROOT.h"
+
+// c++ includes
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <tuple>
+#include <queue>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+
+// posix includes
+#include <unistd.h>
+
+namespace {
+
+struct MergeConfig {
+
+  std::string out_file;
+  std::string spectrum_out = "SignalADCSpectrum_merged.root";
+  std::vector<std::string> in_files;
+  std::vector<std::string> spectrum_files;
+  int threads = 4;
+
+}; // struct MergeConfig
+
+struct InputFile {
+
+  std::string name;
+  std::vector<std::string> trees;
+  std::vector<nnbar::LArCVIndexEntry> index;
+  Long64_t entries = 0;
+  int compression = -1;
+  bool ordered = true;   ///< entry order already follows run/subrun/event
+  bool has_index = false;
+  bool has_compact = false;
+  std::string error;
+
+}; // struct InputFile
+
+typedef std::tuple<UInt_t,UInt_t,UInt_t> EventKey;
+
+EventKey Key(nnbar::LArCVIndexEntry const & e) { return std::make_tuple(e.run,e.subrun,e.event); }
+
+void Usage() {
+  std::cout << "usage: larcv_merge -o OUT.root [options] larcv_1.root [larcv_2.root ...]" << std::endl
+            << "  -j N                   number of scanning threads (default 4)" << std::endl
+            << "  --spectrum FILE        SignalADCSpectrum.root of one job (repeatable)" << std::endl
+            << "  --spectrum-list FILE   text file listing SignalADCSpectrum.root files" << std::endl
+            << "  --spectrum-out FILE    merged spectrum (default SignalADCSpectrum_merged.root)" << std::endl;
+} // function Usage
+
+bool ParseArgs(int argc, char** argv, MergeConfig & cfg) {
+  for (int it = 1; it < argc; ++it) {
+    std::string arg = argv[it];
+    bool has_value = it + 1 < argc;
+    if (arg == "-h" || arg == "--help") return false;
+    else if (arg == "-o" && has_value) cfg.out_file = argv[++it];
+    else if (arg == "-j" && has_value) cfg.threads = std::atoi(argv[++it]);
+    else if (arg == "--spectrum" && has_value) cfg.spectrum_files.push_back(argv[++it]);
+    else if (arg == "--spectrum-out" && has_value) cfg.spectrum_out = argv[++it];
+    else if (arg == "--spectrum-list" && has_value) {
+      std::ifstream list(argv[++it]);
+      std::string line;
+      while (list >> line) cfg.spectrum_files.push_back(line);
+    }
+    else if (arg.size() > 0 && arg[0] == '-') {
+      std::cout << "Unknown option " << arg << std::endl;
+      return false;
+    }
+    else cfg.in_files.push_back(arg);
+  }
+  return !cfg.out_file.empty() && !cfg.in_files.empty() && cfg.threads > 0;
+} // function ParseArgs
+
+/// Names of all TTrees written by larcv into a file
+std::vector<std::string> TreeNames(TFile & f) {
+  std::vector<std::string> names;
+  TIter next(f.GetListOfKeys());
+  while (TKey* key = (TKey*)next()) {
+    if (std::string(key->GetClassName()) != "TTree") continue;
+    if (std::find(names.begin(),names.end(),key->GetName()) == names.end())
+      names.push_back(key->GetName());
+  }
+  std::sort(names.begin(),names.end());
+  return names;
+} // function TreeNames
+
+void ScanInput(InputFile & in) {
+
+  TFile f(in.name.c_str(),"READ");
+  if (f.IsZombie()) {
+    in.error = "cannot open file";
+    return;
+  }
+  in.compression = f.GetCompressionSettings();
+  // larcv only creates its trees on the first get_data, so a job that saved
+  // nothing leaves a file without any
+  in.trees = TreeNames(f);
+  for (size_t it = 0; it < in.trees.size(); ++it) {
+    TTree* tree = (TTree*)f.Get(in.trees[it].c_str());
+    if (it == 0) in.entries = tree->GetEntries();
+    else if (tree->GetEntries() != in.entries) {
+      in.error = "tree " + in.trees[it] + " has a different number of entries";
+      return;
+    }
+  }
+  f.Close();
+  if (in.entries == 0) return;
+
+  // without a sidecar index (WriteIndex: false) the order comes from larcv itself
+  in.has_index = access(nnbar::LArCVIndexFileName(in.name).c_str(),R_OK) == 0;
+  if (in.has_index) {
+    try {
+      nnbar::LArCVIndexReader reader(nnbar::LArCVIndexFileName(in.name));
+      in.index = reader.Entries();
+    }
+    catch (std::exception const & e) {
+      in.error = e.what();
+      return;
+    }
+    if ((Long64_t)in.index.size() != in.entries) {
+      in.error = "index does not cover every entry";
+      return;
+    }
+  }
+
+  in.has_compact = access(nnbar::CompactImageFileName(in.name).c_str(),R_OK) == 0;
+} // function ScanInput
+
+/// Builds a minimal index from the event id larcv stores with every entry
+void IndexFromEventIds(InputFile & in) {
+
+  larcv::IOManager mgr(larcv::IOManager::kREAD);
+  mgr.add_in_file(in.name);
+  mgr.initialize();
+  for (Long64_t it = 0; it < in.entries; ++it) {
+    mgr.read_entry(it);
+    auto roi_v = (larcv::EventROI*)(mgr.get_data(larcv::kProductROI, "tpc"));
+    nnbar::LArCVIndexEntry e;
+    e.entry = it;
+    e.run = roi_v->run();
+    e.subrun = roi_v->subrun();
+    e.event = roi_v->event();
+    e.apa = -1;
+    e.tpc = -1;
+    e.event_type = -1;
+    e.first_tick = 0;
+    e.pixel_sum = 0;
+    e.active_pixels = 0;
+    in.index.push_back(e);
+  }
+  mgr.finalize();
+  std::sort(in.index.begin(),in.index.end());
+} // function IndexFromEventIds
+
+/// Fast-clones every larcv tree of the given files, in order, into one file
+void FastMerge(std::vector<std::string> const & in_files, std::vector<std::string> const & trees,
+    std::string const & out_file, int compression) {
+
+  TFile out(out_file.c_str(),"RECREATE");
+  out.SetCompressionSettings(compression);
+  for (std::string const & name : trees) {
+    TChain chain(name.c_str());
+    for (std::string const & in : in_files) chain.Add(in.c_str());
+    chain.Merge(&out,0,"fast keep");
+  }
+  out.Close();
+} // function FastMerge
+
+/// Copies entries in the given order, keeping one open tree per input
+void OrderedMerge(std::vector<InputFile> const & inputs, std::vector<std::string> const & trees,
+    std::vector<std::pair<size_t,Long64_t>> const & order, std::string const & out_file) {
+
+  TFile out(out_file.c_str(),"RECREATE");
+  out.SetCompressionSettings(inputs.front().compression);
+  for (std::string const & name : trees) {
+    std::vector<std::unique_ptr<TFile>> files(inputs.size());
+    std::vector<TTree*> in_trees(inputs.size(),nullptr);
+    for (size_t it = 0; it < inputs.size(); ++it) {
+      files[it].reset(new TFile(inputs[it].name.c_str(),"READ"));
+      in_trees[it] = (TTree*)files[it]->Get(name.c_str());
+    }
+    out.cd();
+    TTree* tree = in_trees[0]->CloneTree(0);
+    // the output branches read from whichever input supplies the next entry
+    size_t current = 0;
+    for (std::pair<size_t,Long64_t> const & it : order) {
+      if (it.first != current) {
+        in_trees[it.first]->CopyAddresses(tree);
+        current = it.first;
+      }
+      in_trees[it.first]->GetEntry(it.second);
+      tree->Fill();
+    }
+    tree->Write();
+    // detach the output from the input buffers before the inputs close
+    in_trees[current]->CopyAddresses(tree,true);
+  }
+  out.Close();
+} // function OrderedMerge
+
+/// Writes the merged index, compact images and ADC spectrum
+void MergeMetadata(MergeConfig const & cfg, std::vector<InputFile> const & inputs,
+    std::vector<std::pair<size_t,Long64_t>> const & order) {
+
+  // per-input lookup from original to merged entry number
+  std::vector<std::vector<Long64_t>> new_entry(inputs.size());
+  for (size_t it = 0; it < inputs.size(); ++it)
+    new_entry[it].resize(inputs[it].entries,-1);
+  for (size_t it = 0; it < order.size(); ++it)
+    new_entry[order[it].first][order[it].second] = it;
+
+  // rebuilt indices only carry event ids, so a partial index is not written
+  if (std::all_of(inputs.begin(),inputs.end(),[](InputFile const & in) { return in.has_index; })) {
+    nnbar::LArCVIndexWriter index;
+    for (size_t it_file = 0; it_file < inputs.size(); ++it_file) {
+      for (nnbar::LArCVIndexEntry e : inputs[it_file].index) {
+        e.entry = new_entry[it_file][e.entry];
+        index.Add(e);
+      }
+    }
+    index.Write(nnbar::LArCVIndexFileName(cfg.out_file));
+  }
+  else std::cout << "Not writing the merged index: some inputs have none" << std::endl;
+
+  bool all_compact = std::all_of(inputs.begin(),inputs.end(),
+      [](InputFile const & in) { return in.has_compact; });
+  bool any_compact = std::any_of(inputs.begin(),inputs.end(),
+      [](InputFile const & in) { return in.has_compact; });
+  if (any_compact && !all_compact)
+    std::cout << "Not merging compact images: only some inputs have them" << std::endl;
+  else if (any_compact) {
+    std::vector<std::unique_ptr<nnbar::CompactImageReader>> readers(inputs.size());
+    for (size_t it = 0; it < inputs.size(); ++it)
+      if (inputs[it].has_compact)
+        readers[it].reset(new nnbar::CompactImageReader(nnbar::CompactImageFileName(inputs[it].name)));
+    nnbar::CompactImageWriter writer;
+    writer.Open(nnbar::CompactImageFileName(cfg.out_file),nnbar::kPixelInt16,1,0);
+    for (size_t it = 0; it < order.size(); ++it) {
+      nnbar::CompactImageReader & reader = *readers[order[it].first];
+      for (size_t it_image = 0; it_image < reader.NumberImages(order[it].second); ++it_image) {
+        nnbar::CompactImage image = reader.RawImage(order[it].second,it_image);
+        image.entry = it;
+        writer.FillRaw(image);
+      }
+    }
+    writer.Close();
+  }
+
+  if (cfg.spectrum_files.empty()) return;
+  std::vector<std::string> spectra = cfg.spectrum_files;
+  std::sort(spectra.begin(),spectra.end());
+  TH1D* hADCSpectrum = nullptr;
+  for (std::string const & name : spectra) {
+    TFile f(name.c_str(),"READ");
+    TH1D* h = (TH1D*)f.Get("hADCSpectrum");
+    if (!h) {
+      std::cout << "No hADCSpectrum in " << name << ", skipping" << std::endl;
+      continue;
+    }
+    if (!hADCSpectrum) {
+      hADCSpectrum = (TH1D*)h->Clone("hADCSpectrum");
+      hADCSpectrum->SetDirectory(nullptr);
+    }
+    else hADCSpectrum->Add(h);
+  }
+  if (hADCSpectrum) {
+    TFile out(cfg.spectrum_out.c_str(),"RECREATE");
+    hADCSpectrum->Write();
+    out.Close();
+    delete hADCSpectrum;
+  }
+} // function MergeMetadata
+
+} // namespace
+
+int main(int argc, char** argv) {
+
+  MergeConfig cfg;
+  if (!ParseArgs(argc,argv,cfg)) {
+    Usage();
+    return 1;
+  }
+  ROOT::EnableThreadSafety();
+
+  // scan inputs in parallel; each thread only touches its own InputFile
+  std::vector<InputFile> inputs(cfg.in_files.size());
+  for (size_t it = 0; it < inputs.size(); ++it) inputs[it].name = cfg.in_files[it];
+  std::atomic<size_t> next_input(0);
+  std::vector<std::thread> pool;
+  for (int it = 0; it < std::min<int>(cfg.threads,inputs.size()); ++it)
+    pool.emplace_back([&]() {
+      for (size_t i = next_input++; i < inputs.size(); i = next_input++)
+        ScanInput(inputs[i]);
+    });
+  for (std::thread & t : pool) t.join();
+
+  bool failed = false;
+  for (InputFile const & in : inputs) {
+    if (in.error.empty()) continue;
+    std::cout << in.name << ": " << in.error << std::endl;
+    failed = true;
+  }
+  if (failed) return 1;
+
+  // inputs from jobs that saved no entries have nothing to merge
+  for (InputFile const & in : inputs)
+    if (in.entries == 0) std::cout << "Skipping " << in.name << ": no entries" << std::endl;
+  inputs.erase(std::remove_if(inputs.begin(),inputs.end(),
+      [](InputFile const & in) { return in.entries == 0; }),inputs.end());
+  if (inputs.empty()) {
+    std::cout << "No entries to merge" << std::endl;
+    return 1;
+  }
+  std::vector<std::string> trees = inputs.front().trees;
+  for (InputFile const & in : inputs) {
+    if (in.trees == trees) continue;
+    std::cout << in.name << ": larcv trees differ from " << inputs.front().name << std::endl;
+    failed = true;
+  }
+  if (failed) return 1;
+
+  // larcv's IOManager is only used here, on the main thread
+  for (InputFile & in : inputs) {
+    if (!in.has_index) {
+      std::cout << "No index for " << in.name << ", ordering by larcv event ids" << std::endl;
+      IndexFromEventIds(in);
+    }
+    // the index is sorted by event id; entries are in order if nothing moved
+    for (size_t it = 0; it < in.index.size(); ++it)
+      if (in.index[it].entry != it) in.ordered = false;
+  }
+
+  // sort inputs by their first event, ties by name
+  std::sort(inputs.begin(),inputs.end(),[](InputFile const & a, InputFile const & b) {
+      return std::make_tuple(Key(a.index.front()),a.name) < std::make_tuple(Key(b.index.front()),b.name);
+    });
+
+  bool fast = true;
+  Long64_t offset = 0;
+  for (size_t it = 0; it < inputs.size(); ++it) {
+    offset += inputs[it].entries;
+    if (!inputs[it].ordered || inputs[it].compression != inputs.front().compression) fast = false;
+    if (it > 0 && !(Key(inputs[it-1].index.back()) < Key(inputs[it].index.front()))) fast = false;
+  }
+
+  // output order as (input, entry) pairs
+  std::vector<std::pair<size_t,Long64_t>> order;
+  order.reserve(offset);
+  if (fast) {
+    for (size_t it = 0; it < inputs.size(); ++it)
+      for (Long64_t entry = 0; entry < inputs[it].entries; ++entry)
+        order.push_back(std::make_pair(it,entry));
+  }
+  else {
+    // k-way merge of the per-input indices, which the reader sorts by event id;
+    // heads are (event, input, position in that input's index)
+    typedef std::tuple<EventKey,size_t,size_t> Head;
+    std::priority_queue<Head,std::vector<Head>,std::greater<Head>> heads;
+    for (size_t it = 0; it < inputs.size(); ++it)
+      if (!inputs[it].index.empty()) heads.push(std::make_tuple(Key(inputs[it].index.front()),it,0));
+    while (!heads.empty()) {
+      size_t in = std::get<1>(heads.top());
+      size_t position = std::get<2>(heads.top());
+      heads.pop();
+      order.push_back(std::make_pair(in,(Long64_t)inputs[in].index[position].entry));
+      if (++position < inputs[in].index.size())
+        heads.push(std::make_tuple(Key(inputs[in].index[position]),in,position));
+    }
+  }
+  std::cout << "Merging " << offset << " entries from " << inputs.size() << " files ("
+            << (fast ? "fast clone" : "entry by entry") << ")" << std::endl;
+
+  // metadata goes to separate files, so it is written alongside the trees
+  std::thread metadata(MergeMetadata,std::cref(cfg),std::cref(inputs),std::cref(order));
+
+  if (fast) {
+    std::vector<std::string> names;
+    for (InputFile const & in : inputs) names.push_back(in.name);
+    FastMerge(names,trees,cfg.out_file,inputs.front().compression);
+  }
+  else OrderedMerge(inputs,trees,order,cfg.out_file);
+
+  metadata.join();
+  std::cout << "Wrote " << cfg.out_file << std::endl;
+  return 0;
+} // function main
@@ -0,0 +1,198 @@
+// Regenerates larcv images from LArCVMaker waveform caches (WriteWaveformCache)
+// without running art. Every imaging choice the module makes can be changed
+// here, so new ROI windows, planes or thresholds only cost a pass over the
+// mapped cache instead of a full art job over the original ROOT input.
+
+// local includes
+#include "DataFormat/EventImage2D.h"
+#include "DataFormat/EventROI.h"
+#include "DataFormat/IOManager.h"
+#include "nnbar/LArCVMaker/LArCVIndex.h"
+#include "nnbar/LArCVMaker/WaveformCache.h"
+
+// c++ includes
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+
+namespace {
+
+struct ReimageConfig {
+
+  std::string out_file = "larcv_reimage.root";
+  std::vector<std::string> in_files;
+  int plane = 2;
+  int first_tick = 0;
+  int last_tick = 4487;
+  int wire_downsample = 1;
+  int tick_downsample = 1;
+  int adc_cut = 0;
+  int index_adc_cut = 20;
+  bool subtract_pedestal = false;
+  int event_type = -1;
+  bool write_index = true;
+
+}; // struct ReimageConfig
+
+void Usage() {
+  std::cout << "usage: larcv_reimage [options] cache.wfc [cache.wfc ...]" << std::endl
+            << "  -o FILE               output larcv file (default larcv_reimage.root)" << std::endl
+            << "  --plane N             0, 1 or 2 (default 2)" << std::endl
+            << "  --first-tick N        first tick of the window (default 0)" << std::endl
+            << "  --last-tick N         last tick of the window (default 4487)" << std::endl
+            << "  --wire-downsample N   compress wires by N (default 1)" << std::endl
+            << "  --tick-downsample N   compress ticks by N (default 1)" << std::endl
+            << "  --subtract-pedestal   subtract the RawDigit pedestal" << std::endl
+            << "  --adc-cut N           zero pixels at or below N (default 0, off)" << std::endl
+            << "  --index-adc-cut N     index activity threshold above pedestal (default 20)" << std::endl
+            << "  --event-type N        ROI type written for every entry (default: cached EventType)" << std::endl
+            << "  --no-index            do not write the sidecar index" << std::endl;
+} // function Usage
+
+bool ParseArgs(int argc, char** argv, ReimageConfig & cfg) {
+  for (int it = 1; it < argc; ++it) {
+    std::string arg = argv[it];
+    bool has_value = it + 1 < argc;
+    if (arg == "-h" || arg == "--help") return false;
+    else if (arg == "--subtract-pedestal") cfg.subtract_pedestal = true;
+    else if (arg == "--no-index") cfg.write_index = false;
+    else if (arg == "-o" && has_value) cfg.out_file = argv[++it];
+    else if (arg == "--plane" && has_value) cfg.plane = std::atoi(argv[++it]);
+    else if (arg == "--first-tick" && has_value) cfg.first_tick = std::atoi(argv[++it]);
+    else if (arg == "--last-tick" && has_value) cfg.last_tick = std::atoi(argv[++it]);
+    else if (arg == "--wire-downsample" && has_value) cfg.wire_downsample = std::atoi(argv[++it]);
+    else if (arg == "--tick-downsample" && has_value) cfg.tick_downsample = std::atoi(argv[++it]);
+    else if (arg == "--adc-cut" && has_value) cfg.adc_cut = std::atoi(argv[++it]);
+    else if (arg == "--index-adc-cut" && has_value) cfg.index_adc_cut = std::atoi(argv[++it]);
+    else if (arg == "--event-type" && has_value) cfg.event_type = std::atoi(argv[++it]);
+    else if (arg.size() > 0 && arg[0] == '-') {
+      std::cout << "Unknown option " << arg << std::endl;
+      return false;
+    }
+    else cfg.in_files.push_back(arg);
+  }
+  if (cfg.in_files.empty() || cfg.plane < 0 || cfg.plane > 2
+      || cfg.first_tick < 0 || cfg.last_tick < cfg.first_tick
+      || cfg.wire_downsample < 1 || cfg.tick_downsample < 1)
+    return false;
+
+  // larcv throws from Image2D::compress on a non-divisor, so catch it before any file is touched
+  const int number_wires[3] = { 800, 800, 480 };
+  if (number_wires[cfg.plane] % cfg.wire_downsample != 0) {
+    std::cout << "--wire-downsample " << cfg.wire_downsample << " does not divide the "
+              << number_wires[cfg.plane] << " wires of plane " << cfg.plane << std::endl;
+    return false;
+  }
+  if ((cfg.last_tick - cfg.first_tick + 1) % cfg.tick_downsample != 0) {
+    std::cout << "--tick-downsample " << cfg.tick_downsample << " does not divide the "
+              << cfg.last_tick - cfg.first_tick + 1 << " ticks of the window" << std::endl;
+    return false;
+  }
+  return true;
+} // function ParseArgs
+
+} // namespace
+
+int main(int argc, char** argv) {
+
+  ReimageConfig cfg;
+  if (!ParseArgs(argc,argv,cfg)) {
+    Usage();
+    return 1;
+  }
+
+  larcv::IOManager mgr(larcv::IOManager::kWRITE);
+  mgr.set_out_file(cfg.out_file);
+  mgr.initialize();
+  nnbar::LArCVIndexWriter index;
+  size_t entry = 0;
+
+  // plane layout within an APA, as in LArCVMaker
+  const int first_channel[3] = { 0, 800, 1600 };
+  const int number_channels[3] = { 800, 800, 960 };
+
+  for (std::string const & in_file : cfg.in_files) {
+    nnbar::WaveformCacheReader cache(in_file);
+    std::cout << "Reading " << cache.size() << " events from " << in_file << std::endl;
+
+    for (size_t it_event = 0; it_event < cache.size(); ++it_event) {
+      nnbar::WaveformEvent e = cache.Event(it_event);
+      int nticks = e.header->nticks;
+      if (cfg.first_tick >= nticks) {
+        std::cout << "Skipping event " << e.header->event << ". Tick window outside readout!" << std::endl;
+        continue;
+      }
+      int last_tick = std::min(cfg.last_tick,nticks-1);
+
+      // collection plane is split between the two TPCs of the APA
+      int first_wire = first_channel[cfg.plane];
+      int number_wires = number_channels[cfg.plane];
+      if (cfg.plane == 2) {
+        number_wires /= 2;
+        if (e.header->tpc%2 == 1) first_wire += number_wires;
+      }
+      int number_ticks = last_tick - cfg.first_tick + 1;
+      // a readout shorter than the window is cropped to a multiple of the downsampling
+      number_ticks -= number_ticks % cfg.tick_downsample;
+      if (number_ticks == 0) {
+        std::cout << "Skipping event " << e.header->event << ". Readout shorter than one downsampled tick!" << std::endl;
+        continue;
+      }
+      int event_type = cfg.event_type >= 0 ? cfg.event_type : e.header->event_type;
+
+      mgr.set_id(e.header->run,e.header->subrun,e.header->event);
+      auto images = (larcv::EventImage2D*)(mgr.get_data(larcv::kProductImage2D, "tpc"));
+
+      double pixel_sum = 0;
+      unsigned int active_pixels = 0;
+      larcv::Image2D image(number_wires,number_ticks);
+      for (int it_channel = 0; it_channel < number_wires; ++it_channel) {
+        int16_t const * waveform = e.Waveform(first_wire + it_channel);
+        float pedestal = e.pedestal[first_wire + it_channel];
+        float image_pedestal = cfg.subtract_pedestal ? pedestal : 0;
+        for (int it_tick = 0; it_tick < number_ticks; ++it_tick) {
+          // index activity is always measured above pedestal, as in LArCVMaker
+          float charge = waveform[it_tick + cfg.first_tick] - pedestal;
+          if (charge > cfg.index_adc_cut) {
+            pixel_sum += charge;
+            ++active_pixels;
+          }
+          float value = waveform[it_tick + cfg.first_tick] - image_pedestal;
+          if (cfg.adc_cut > 0 && value <= cfg.adc_cut) continue;
+          image.set_pixel(it_channel,it_tick,value);
+        }
+      }
+      if (cfg.wire_downsample > 1 || cfg.tick_downsample > 1)
+        image.compress(number_wires/cfg.wire_downsample,number_ticks/cfg.tick_downsample);
+      images->Emplace(std::move(image));
+
+      auto roi_v = (larcv::EventROI*)(mgr.get_data(larcv::kProductROI, "tpc"));
+      larcv::ROI roi((larcv::ROIType_t)event_type);
+      roi_v->Emplace(std::move(roi));
+
+      if (cfg.write_index) {
+        nnbar::LArCVIndexEntry record;
+        record.entry = entry;
+        record.run = e.header->run;
+        record.subrun = e.header->subrun;
+        record.event = e.header->event;
+        record.apa = e.header->apa;
+        record.tpc = e.header->tpc;
+        record.event_type = event_type;
+        record.first_tick = cfg.first_tick;
+        record.pixel_sum = pixel_sum;
+        record.active_pixels = active_pixels;
+        index.Add(record);
+      }
+      mgr.save_entry();
+      ++entry;
+    }
+  }
+
+  mgr.finalize();
+  if (cfg.write_index) index.Write(nnbar::LArCVIndexFileName(cfg.out_file));
+  std::cout << "Wrote " << entry << " entries to " << cfg.out_file << std::endl;
+  return 0;
+} // function main